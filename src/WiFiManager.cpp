@@ -11,6 +11,14 @@
 #include <ping/ping_sock.h>
 #include <nvs_flash.h>
 #include <nvs.h>
+#include <freertos/event_groups.h>
+#include <esp_timer.h>
+#include <esp_rom_crc.h>
+#include <esp_netif.h>
+#include <esp_netif_net_stack.h>
+#include <lwip/dhcp.h>
+#include <lwip/tcpip.h>
+#include <lwip/etharp.h>
 #include "WiFiManager.h"
 
 #if defined(WFM_SHOW_LOG)
@@ -23,6 +31,42 @@
 #define LOG_ERR(format, ...)
 #endif
 
+// library tasks stack size, bytes
+#if !defined(WFM_DNS_STACK_SIZE)
+#define WFM_DNS_STACK_SIZE (1024 * 2)
+#endif
+
+#if !defined(WFM_PING_STACK_SIZE)  // ping and got IP probe, user ping callbacks are called here
+#if CONFIG_IDF_TARGET_ESP32S3
+#define WFM_PING_STACK_SIZE (1024 * 6)
+#else
+#define WFM_PING_STACK_SIZE (1024 * 4)
+#endif
+#endif
+
+#if !defined(WFM_HTTPD_STACK_SIZE)
+#if CONFIG_IDF_TARGET_ESP32S3
+#define WFM_HTTPD_STACK_SIZE (1024 * 8)
+#else
+#define WFM_HTTPD_STACK_SIZE (1024 * 4)  // HTTPD_DEFAULT_CONFIG()
+#endif
+#endif
+
+// library tasks core affinity and priority
+static wfm_tasks_cfg_t tasksCfg = {
+    .dns = {.core = -1, .priority = tskIDLE_PRIORITY + 1},
+    .ping = {.core = -1, .priority = 1},
+    .httpd = {.core = -1, .priority = tskIDLE_PRIORITY + 5},  // HTTPD_DEFAULT_CONFIG()
+};
+
+static BaseType_t taskCore(const wfm_task_cfg_t *cfg) {
+    return (cfg->core < 0) ? tskNO_AFFINITY : cfg->core;
+}
+
+#if defined(CONFIG_LWIP_MAX_SOCKETS) && (WFM_PORTAL_MAX_SOCKETS > CONFIG_LWIP_MAX_SOCKETS - 3)
+#error "WFM_PORTAL_MAX_SOCKETS must be <= CONFIG_LWIP_MAX_SOCKETS - 3 (3 sockets are used by httpd internally)"
+#endif
+
 // maximum size of a SSID name. 32 is IEEE standard. @warning limit is also hard coded in wifi_config_t. Never extend this value
 #define MAX_SSID_SIZE 32
 
@@ -42,23 +86,217 @@ static char ST_gw[16] = "";    // gateway to internet, normally router IP
 static char ST_dns1[16] = "";  // DNS Server, can be router IP (needed for SNTP)
 static char ST_dns2[16] = "";  // alternative DNS Server, can be blank
 
+// last DHCP lease, addresses in network byte order
+typedef struct {
+    uint32_t ip;
+    uint32_t netmask;
+    uint32_t gw;
+    uint32_t dns;
+    uint32_t start;     // lease start time(NULL), 0 if system time is not set
+    uint32_t duration;  // lease time, s
+} wifi_lease_t;
+
+static wifi_lease_t ST_lease = {};
+static wfm_lease_mode_t leaseMode = WFM_LEASE_OFF;
+static bool leaseApplied = false;  // cached lease is set as static IP (WFM_LEASE_APPLY)
+static bool leaseDhcpStarted = false;  // DHCP client is started behind the applied lease
+static uint32_t beginTime = 0;     // millis() at WiFi.begin()
+static uint32_t timeToIP = 0;      // time from WiFi.begin() to got IP, ms
+
+static bool ipConflictCheck = true;  // ARP probe of static IP before use
+static wfm_ip_fallback_t ipFallback = WFM_IP_FALLBACK_DHCP;
+static wfm_ip_status_t ipStatus = WFM_IP_DHCP;
+static bool ipChecked = false;       // static IP check is done (or not needed)
+static bool ipProbePending = false;  // STA is connecting without IP, apply static IP after ARP probe
+static uint32_t ipCommitted = 0;     // applied static IP, network byte order
+
 #define START_WIFI_WAIT_SEC 15  // timeout WL_CONNECTED after board start
 
 static bool AP_started = false;            // internal flag AP state
 static bool AP_hidden = false;             // create hidden AP
+static uint8_t AP_max_clients = 1;         // max stations connected to AP
+static uint8_t AP_channel = 1;             // AP channel: STA channel or least-congested of 1/6/11
 static bool firstPingOK = false;           // internal flag first successful connection
+static wfm_ready_policy_t readyPolicy = WFM_READY_ON_PING;  // when to fire first successful connection event
+static uint32_t startTime = 0;             // millis() at start()
+static uint32_t readyTime = 0;             // time from start() to first successful connection event, ms
+static portMUX_TYPE readyMux = portMUX_INITIALIZER_UNLOCKED;
 static callback_fn_t onConnect_cb = NULL;  // pointer to callback function on first successful connection event
 static callback_fn_t onPingOK_cb = NULL;   // pointer to callback function on ping success event
 static callback_fn_t onPingERR_cb = NULL;  // pointer to callback function on ping timeout event
 
+#pragma region "Profiler"
+
+#if WFM_PROFILE_ENABLE
+
+static wfm_profile_t profile = {};
+
+// update the statistics on leaving the scope, or on end() if the scope is never left (restart)
+class ProfileScope {
+   private:
+    wfm_handler_stat_t &stat;
+    int64_t start_us;
+    uint32_t start_heap;
+    bool done;
+
+   public:
+    ProfileScope(wfm_handler_stat_t &stat) : stat(stat), start_us(esp_timer_get_time()), start_heap(esp_get_free_heap_size()), done(false) {}
+    ~ProfileScope() {
+        end();
+    }
+
+    void end() {
+        if (done)
+            return;
+        done = true;
+
+        uint32_t time_us = esp_timer_get_time() - start_us;
+        int32_t heap_delta = (int32_t)esp_get_free_heap_size() - (int32_t)start_heap;
+        uint32_t stack_free = uxTaskGetStackHighWaterMark(NULL);
+
+        stat.calls++;
+        stat.time_total_us += time_us;
+        if (time_us > stat.time_max_us)
+            stat.time_max_us = time_us;
+        if (heap_delta < stat.heap_delta_min)
+            stat.heap_delta_min = heap_delta;
+        if (!stat.stack_free_min || stack_free < stat.stack_free_min)
+            stat.stack_free_min = stack_free;
+    }
+};
+
+#define PROFILE_SCOPE(stat) ProfileScope profile_scope(profile.stat)
+#define PROFILE_SCOPE_END() profile_scope.end()
+#else
+#define PROFILE_SCOPE(stat)
+#define PROFILE_SCOPE_END()
+#endif
+
+#pragma endregion
+
+#pragma region "Journal"
+
+#define JOURNAL_MAGIC 0x57464D4A  // "WFMJ"
+
+// connection events ring, survives the software reset
+typedef struct {
+    uint32_t magic;
+    uint16_t head;   // next entry index
+    uint16_t count;  // stored entries
+    uint32_t crc;    // header crc (magic, head, count)
+    wfm_journal_entry_t entries[WFM_JOURNAL_SIZE];
+    uint8_t entries_crc[WFM_JOURNAL_SIZE];  // crc8 of each entry
+} wifi_journal_t;
+
+static RTC_NOINIT_ATTR wifi_journal_t journal;
+static portMUX_TYPE journalMux = portMUX_INITIALIZER_UNLOCKED;
+static volatile int8_t lastRSSI = 0;
+
+static uint32_t journal_crc() {
+    return esp_rom_crc32_le(0, (const uint8_t *)&journal, offsetof(wifi_journal_t, crc));
+}
+
+static uint8_t journal_entry_crc(uint16_t index) {
+    return esp_rom_crc8_le(0, (const uint8_t *)&journal.entries[index], sizeof(wfm_journal_entry_t));
+}
+
+static bool journal_entries_valid() {
+    for (uint16_t i = 0; i < journal.count; ++i) {
+        uint16_t index = (journal.head + WFM_JOURNAL_SIZE - 1 - i) % WFM_JOURNAL_SIZE;
+        if (journal.entries_crc[index] != journal_entry_crc(index))
+            return false;
+    }
+    return true;
+}
+
+static void journal_init() {
+    if (journal.magic != JOURNAL_MAGIC || journal.head >= WFM_JOURNAL_SIZE ||
+        journal.count > WFM_JOURNAL_SIZE || journal.crc != journal_crc() || !journal_entries_valid()) {
+        // power on or damaged
+        memset(&journal, 0, sizeof(journal));
+        journal.magic = JOURNAL_MAGIC;
+        journal.crc = journal_crc();
+    }
+}
+
+static void journal_add(wfm_event_t event, uint32_t data) {
+    portENTER_CRITICAL(&journalMux);
+    wfm_journal_entry_t *entry = &journal.entries[journal.head];
+    entry->time_ms = millis();
+    entry->event = event;
+    entry->rssi = lastRSSI;
+    entry->data = (data > UINT16_MAX) ? UINT16_MAX : data;
+    journal.entries_crc[journal.head] = journal_entry_crc(journal.head);
+    journal.head = (journal.head + 1) % WFM_JOURNAL_SIZE;
+    if (journal.count < WFM_JOURNAL_SIZE)
+        journal.count++;
+    journal.crc = journal_crc();
+    portEXIT_CRITICAL(&journalMux);
+}
+
+#pragma endregion
+
+#pragma region "Connection state"
+
+static StaticEventGroup_t stateEventGroupBuf;
+static EventGroupHandle_t stateEventGroup = NULL;  // one bit per wfm_state_t
+static StaticSemaphore_t stateMutexBuf;
+static SemaphoreHandle_t stateMutex = NULL;
+static volatile wfm_state_t wfmState = WFM_STATE_IDLE;
+static volatile uint32_t wfmStateGen = 0;  // incremented on each state change
+
+static EventBits_t stateBits(wfm_state_t state) {
+    EventBits_t bits = BIT(state);
+    if (state == WFM_STATE_ONLINE)
+        bits |= BIT(WFM_STATE_CONNECTED);  // online is connected too
+    return bits;
+}
+
+static void setState(wfm_state_t state) {
+    xSemaphoreTake(stateMutex, portMAX_DELAY);
+    if (wfmState != state) {
+        const EventBits_t all_bits = BIT(WFM_STATE_RECOVERING + 1) - 1;
+        xEventGroupClearBits(stateEventGroup, all_bits & ~stateBits(state));
+        xEventGroupSetBits(stateEventGroup, stateBits(state));
+        wfmState = state;
+        wfmStateGen++;
+        LOG_INF("WiFiManager state: %d", state);
+    }
+    xSemaphoreGive(stateMutex);
+}
+
+#pragma endregion
+
 #pragma region "Configuration Portal"
 
 #define WIFI_SCAN_LIST_SIZE 6
+
+typedef struct {
+    char ssid[MAX_SSID_SIZE + 1];
+    uint8_t channel;
+} wifi_scan_item_t;
+
 static uint8_t wifiScanListCnt = 0;
-static char *wifiScanList = NULL;
+static wifi_scan_item_t *wifiScanList = NULL;
 
 static httpd_handle_t cfgPortalHttpServer = NULL;
 
+#define MAX_PARAM_ID_SIZE 15    // NVS key length limit
+#define MAX_PARAM_TEXT_SIZE 64  // text parameter max length
+
+// user parameter, id and label must be static strings
+typedef struct {
+    const char *id;
+    const char *label;
+    void *value;  // char[max + 1] or int32_t
+    int32_t min;  // int: min value
+    int32_t max;  // int: max value, text: max length
+    bool is_int;
+} wifi_param_t;
+
+static wifi_param_t params[WFM_MAX_PARAMS];
+static uint8_t paramsCnt = 0;
+
 static void startCfgPortalServer();
 static void stopCfgPortalServer();
 
@@ -68,7 +306,46 @@ static void stopCfgPortalServer();
 
 #define PING_INTERVAL_SEC 30  // how often to check wifi status
 static esp_ping_handle_t pingHandle = NULL;
+static esp_ping_handle_t probeHandle = NULL;  // one-shot ping on got IP
+static volatile bool probeDone = false;
 static void startPing();
+static void startProbe();
+static void stopProbe();
+
+#pragma endregion
+
+#pragma region "Reconnect backoff"
+
+// decorrelated jitter: delay = min(cap, random(base, prev_delay * 3))
+static uint32_t backoffBaseMs = 1000;     // min reconnect delay
+static uint32_t backoffCapMs = 60000;     // max reconnect delay
+static uint32_t backoffResetMs = 300000;  // stable connection time to reset the delay
+static uint32_t backoffDelayMs = 0;       // last reconnect delay, 0 - reset
+static uint32_t backoffRng = 1;           // xorshift32 state, seeded by MAC
+static uint32_t reconnectTime = 0;        // millis() of the last reconnect
+
+static uint32_t backoff_rand() {
+    backoffRng ^= backoffRng << 13;
+    backoffRng ^= backoffRng >> 17;
+    backoffRng ^= backoffRng << 5;
+    return backoffRng;
+}
+
+static uint32_t backoff_next() {
+    uint32_t prev = backoffDelayMs ? backoffDelayMs : backoffBaseMs;
+    uint32_t hi = (prev > backoffCapMs / 3) ? backoffCapMs : prev * 3;
+    if (hi < backoffBaseMs)
+        hi = backoffBaseMs;
+    backoffDelayMs = backoffBaseMs + backoff_rand() % (hi - backoffBaseMs + 1);
+    return backoffDelayMs;
+}
+
+static void backoff_check_reset() {
+    if (backoffDelayMs && (millis() - reconnectTime >= backoffResetMs)) {
+        LOG_INF("Reconnect delay reset");
+        backoffDelayMs = 0;
+    }
+}
 
 #pragma endregion
 
@@ -94,7 +371,8 @@ static void startDnsServer() {
         p_dnsServer = new DNSServer;
         if (p_dnsServer) {
             p_dnsServer->start(DNS_PORT, "*", WiFi.softAPIP());  // all DNS request
-            xTaskCreate(&DnsServerTask, "Dnstask", 1024 * 2, NULL, tskIDLE_PRIORITY + 1, &dnsServerHandle);
+            xTaskCreatePinnedToCore(&DnsServerTask, "Dnstask", WFM_DNS_STACK_SIZE, NULL,
+                                    tasksCfg.dns.priority, &dnsServerHandle, taskCore(&tasksCfg.dns));
             LOG_INF("startDnsServer");
         }
     }
@@ -170,6 +448,11 @@ static void loadWiFiAuthData() {
                 nvs_get_str(nvs_handle, "gateway", ST_gw, &nvs_required_size);
         }
 
+        if (ESP_OK == nvs_get_blob(nvs_handle, "lease", NULL, &nvs_required_size)) {
+            if (nvs_required_size == sizeof(ST_lease))
+                nvs_get_blob(nvs_handle, "lease", &ST_lease, &nvs_required_size);
+        }
+
         nvs_close(nvs_handle);
     }
 }
@@ -184,39 +467,320 @@ static void saveWiFiAuthData() {
         nvs_set_str(nvs_handle, "ssid", ST_ssid);
         nvs_set_str(nvs_handle, "pswd", ST_pswd);
         nvs_set_str(nvs_handle, "gateway", ST_gw);
+        nvs_set_blob(nvs_handle, "lease", &ST_lease, sizeof(ST_lease));
+
+        for (uint8_t i = 0; i < paramsCnt; ++i) {
+            if (params[i].is_int)
+                nvs_set_i32(nvs_handle, params[i].id, *(int32_t *)params[i].value);
+            else
+                nvs_set_str(nvs_handle, params[i].id, (char *)params[i].value);
+        }
         
         nvs_commit(nvs_handle);
         nvs_close(nvs_handle);
     }
 }
 
+#pragma region "DHCP lease cache"
+
+static struct netif *staNetif() {
+    esp_netif_t *esp_netif = esp_netif_get_handle_from_ifkey("WIFI_STA_DEF");
+    return esp_netif ? (struct netif *)esp_netif_get_netif_impl(esp_netif) : NULL;
+}
+
+/**
+ * Lease time is over, known only if system time was set at the lease start and is set now
+ */
+static bool leaseExpired() {
+    time_t now = time(NULL);
+    return ST_lease.start && ST_lease.duration && now > 1600000000 &&
+           (uint32_t)now - ST_lease.start >= ST_lease.duration;
+}
+
+static void saveLease() {
+    wifi_lease_t lease = {};
+    lease.ip = WiFi.localIP();
+    lease.netmask = WiFi.subnetMask();
+    lease.gw = WiFi.gatewayIP();
+    lease.dns = WiFi.dnsIP();
+
+    time_t now = time(NULL);
+    lease.start = (now > 1600000000) ? now : 0;
+
+    struct netif *netif = staNetif();
+    struct dhcp *dhcp = netif ? netif_dhcp_data(netif) : NULL;
+    lease.duration = dhcp ? dhcp->offered_t0_lease : 0;
+
+    // lease start is changed on every renew, don't wear the flash if the address is the same
+    // and the saved start is not older than half of the lease (an expired lease is not used)
+    if (lease.ip != ST_lease.ip || lease.netmask != ST_lease.netmask ||
+        lease.gw != ST_lease.gw || lease.dns != ST_lease.dns || lease.duration != ST_lease.duration ||
+        (lease.start && ST_lease.duration && lease.start - ST_lease.start >= ST_lease.duration / 2)) {
+        ST_lease = lease;
+        
+        nvs_handle_t nvs_handle;
+        if (nvs_open("wifiAuthData", NVS_READWRITE, &nvs_handle) == ESP_OK) {
+            nvs_set_blob(nvs_handle, "lease", &ST_lease, sizeof(ST_lease));
+            nvs_commit(nvs_handle);
+            nvs_close(nvs_handle);
+            LOG_INF("DHCP lease saved, %lu s", (unsigned long)ST_lease.duration);
+        }
+    }
+}
+
+/**
+ * Got IP with the applied lease. The first one is the cached address: start esp_netif DHCP client
+ * to confirm and renew it. The cached address is requested in INIT-REBOOT state with
+ * CONFIG_LWIP_DHCP_RESTORE_LAST_IP, else by DISCOVER (routers offer the same address to the same MAC).
+ * The next one is the DHCP result, NAK or another address drops the cache.
+ */
+static void leaseGotIP() {
+    if (!leaseDhcpStarted) {
+        leaseDhcpStarted = true;
+        esp_netif_dhcpc_start(esp_netif_get_handle_from_ifkey("WIFI_STA_DEF"));
+        return;
+    }
+
+    if ((uint32_t)WiFi.localIP() != ST_lease.ip) {
+        LOG_WRN("DHCP lease cache rejected, IP from DHCP");
+        journal_add(WFM_EVENT_LEASE_REJECTED, 0);
+    }
+    // esp_netif DHCP client keeps the lease from now on
+    leaseApplied = false;
+    leaseDhcpStarted = false;
+    saveLease();
+}
+
+#pragma endregion
+
+#pragma region "Static IP conflict detection"
+
+#define ARP_PROBE_NUM 3             // RFC 5227 PROBE_NUM
+#define ARP_PROBE_INTERVAL_MS 200   // shortened RFC 5227 PROBE_MIN..PROBE_MAX (1..2 s)
+#define ARP_PROBE_WAIT_MS 500       // wait for the answer after the last probe
+#define IP_NEXT_FREE_TRIES 5        // addresses to try with WFM_IP_FALLBACK_NEXT_FREE
+
+typedef struct {
+    StaticSemaphore_t done_buf;
+    SemaphoreHandle_t done;
+    ip4_addr_t ip;
+    bool found;
+} arp_probe_t;
+
+// runs in the lwIP thread
+static void arpProbeSend(void *ctx) {
+    arp_probe_t *probe = (arp_probe_t *)ctx;
+    struct netif *netif = staNetif();
+    // STA IP is 0.0.0.0: the request is RFC 5227 ARP probe, the answer updates the pending ARP entry
+    if (netif)
+        etharp_query(netif, &probe->ip, NULL);
+    xSemaphoreGive(probe->done);
+}
+
+// runs in the lwIP thread
+static void arpProbeCheck(void *ctx) {
+    arp_probe_t *probe = (arp_probe_t *)ctx;
+    struct netif *netif = staNetif();
+    struct eth_addr *eth_ret;
+    const ip4_addr_t *ip_ret;
+    probe->found = netif && (etharp_find_addr(netif, &probe->ip, &eth_ret, &ip_ret) >= 0);
+    xSemaphoreGive(probe->done);
+}
+
+static void arpProbeExec(void (*fn)(void *), arp_probe_t *probe) {
+    if (tcpip_callback(fn, probe) == ERR_OK)
+        xSemaphoreTake(probe->done, portMAX_DELAY);
+}
+
+/**
+ * ARP probe of the address, STA must be connected without IP
+ * @param ip address, network byte order
+ * @return true if the address is used by another host
+ */
+static bool arpProbe(uint32_t ip) {
+    arp_probe_t probe = {};
+    probe.done = xSemaphoreCreateBinaryStatic(&probe.done_buf);
+    ip4_addr_set_u32(&probe.ip, ip);
+
+    for (uint8_t i = 0; i < ARP_PROBE_NUM; ++i) {
+        arpProbeExec(arpProbeSend, &probe);
+        delay((i < ARP_PROBE_NUM - 1) ? ARP_PROBE_INTERVAL_MS : ARP_PROBE_WAIT_MS);
+        arpProbeExec(arpProbeCheck, &probe);
+        if (probe.found)
+            break;
+    }
+    return probe.found;
+}
+
+/**
+ * Next host address of the subnet
+ * @return address in network byte order, 0 if the subnet is over
+ */
+static uint32_t nextIP(uint32_t ip, uint32_t gw, uint32_t sn) {
+    uint32_t mask = lwip_ntohl(sn);
+    uint32_t host = lwip_ntohl(ip);
+    do {
+        host++;
+    } while (host == lwip_ntohl(gw));
+
+    if ((host & mask) != (lwip_ntohl(ip) & mask) || (host & ~mask) == ~mask)
+        return 0;
+    return lwip_htonl(host);
+}
+
+static void parseStaticIP(IPAddress &ip, IPAddress &gw, IPAddress &sn, IPAddress &dns1) {
+    ip.fromString(ST_ip);
+    gw.fromString(ST_gw);
+    sn.fromString(ST_sn);
+
+    if (strlen(ST_dns1)) {
+        dns1.fromString(ST_dns1);
+    } else {
+        dns1 = gw;
+    }
+}
+
+/**
+ * Keep STA without address for the ARP probe: stop DHCP client started by WiFi.begin() or association
+ */
+static void staClearIP() {
+    esp_netif_t *esp_netif = esp_netif_get_handle_from_ifkey("WIFI_STA_DEF");
+    esp_netif_ip_info_t no_ip = {};
+    esp_netif_dhcpc_stop(esp_netif);
+    esp_netif_set_ip_info(esp_netif, &no_ip);
+}
+
+static void setIPStatus(wfm_ip_status_t status) {
+    ipStatus = status;
+    journal_add(WFM_EVENT_IP_CHECK, status);
+}
+
+/**
+ * Apply static IP after ARP probe, or fallback to DHCP
+ * @param timeout_ms STA association wait
+ */
+static void commitStaticIP(uint32_t timeout_ms) {
+    IPAddress _ip, _gw, _sn, _dns1;
+    parseStaticIP(_ip, _gw, _sn, _dns1);
+
+    // wait for the association only: WiFi.isConnected() needs got IP, and there is no IP until the probe is done
+    if (!(WiFi.waitStatusBits(STA_CONNECTED_BIT, timeout_ms) & STA_CONNECTED_BIT)) {
+        // can't check now, check again on the next reconnect
+        ipProbePending = false;
+        setIPStatus(WFM_IP_STATIC_UNCHECKED);
+        WiFi.config(_ip, _gw, _sn, _dns1);
+        LOG_WRN("Wifi Station static IP is not checked");
+        return;
+    }
+
+    ipChecked = true;
+    uint32_t ip = _ip;
+    uint8_t tries = (ipFallback == WFM_IP_FALLBACK_NEXT_FREE) ? IP_NEXT_FREE_TRIES : 1;
+
+    while (ip && tries--) {
+        if (!arpProbe(ip)) {
+            ipProbePending = false;  // got IP of the applied address is valid
+            ipCommitted = ip;
+            WiFi.config(IPAddress(ip), _gw, _sn, _dns1);
+            setIPStatus((ip == (uint32_t)_ip) ? WFM_IP_STATIC : WFM_IP_STATIC_NEXT);
+            LOG_INF("Wifi Station set static IP %s", IPAddress(ip).toString().c_str());
+            return;
+        }
+        LOG_WRN("IP %s is used by another host", IPAddress(ip).toString().c_str());
+        ip = nextIP(ip, _gw, _sn);
+    }
+
+    ipProbePending = false;
+    setIPStatus(WFM_IP_CONFLICT);
+    WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE);  // DHCP
+    LOG_ERR("Wifi Station static IP conflict, IP from DHCP");
+}
+
+#pragma endregion
+
+static void fireReady() {
+    bool fire = false;
+    portENTER_CRITICAL(&readyMux);
+    if (!firstPingOK) {
+        firstPingOK = true;
+        fire = true;
+    }
+    portEXIT_CRITICAL(&readyMux);
+
+    if (fire) {
+        readyTime = millis() - startTime;
+        LOG_INF("Network ready in %lu ms", (unsigned long)readyTime);
+        if (onConnect_cb)
+            onConnect_cb();
+    }
+}
+
 static void wifi_scan_clear() {
     free(wifiScanList);
     wifiScanList = NULL;
     wifiScanListCnt = 0;
 }
 
+/**
+ * Channel of the scanned network.
+ * @return 0 if the network is not found in the scan cache
+ */
+static uint8_t wifi_scan_channel(const char *ssid) {
+    for (uint8_t i = 0; i < wifiScanListCnt; ++i) {
+        if (!strcmp(wifiScanList[i].ssid, ssid))
+            return wifiScanList[i].channel;
+    }
+    return 0;
+}
+
 static void wifi_scan() {
     wifi_scan_clear();
     int16_t numNetworks = WiFi.scanNetworks();
-    if (numNetworks) {
+    if (numNetworks > 0) {
+        // 2.4GHz channels overlap on +-4 neighbours, count interference for non-overlapping 1/6/11
+        const uint8_t free_channels[] = {1, 6, 11};
+        uint16_t congestion[sizeof(free_channels)] = {0};
+        uint8_t st_channel = 0;
+
+        for (int16_t i = 0; i < numNetworks; ++i) {
+            uint8_t channel = WiFi.channel(i);
+            for (uint8_t j = 0; j < sizeof(free_channels); ++j) {
+                uint8_t dist = abs(channel - free_channels[j]);
+                if (dist < 5)
+                    congestion[j] += 5 - dist;
+            }
+            if (!st_channel && strlen(ST_ssid) && !strcmp(WiFi.SSID(i).c_str(), ST_ssid))
+                st_channel = channel;
+        }
+
+        if (st_channel) {
+            AP_channel = st_channel;
+        } else {
+            uint8_t best = 0;
+            for (uint8_t j = 1; j < sizeof(free_channels); ++j) {
+                if (congestion[j] < congestion[best])
+                    best = j;
+            }
+            AP_channel = free_channels[best];
+        }
+        LOG_INF("AP channel: %u", AP_channel);
+
         if (numNetworks > WIFI_SCAN_LIST_SIZE)
             numNetworks = WIFI_SCAN_LIST_SIZE;
         
-        wifiScanListCnt = numNetworks;
-        wifiScanList = (char *)malloc(wifiScanListCnt * sizeof(AP_ssid));
+        wifiScanList = (wifi_scan_item_t *)malloc(numNetworks * sizeof(wifi_scan_item_t));
         if (wifiScanList) {
-            char *pwifiScanList = wifiScanList;
+            wifiScanListCnt = numNetworks;
             for (uint8_t i = 0; i < wifiScanListCnt; ++i) {
-                memcpy(pwifiScanList, WiFi.SSID(i).c_str(), sizeof(AP_ssid));
-                pwifiScanList += sizeof(AP_ssid);
+                snprintf(wifiScanList[i].ssid, sizeof(wifiScanList[i].ssid), "%s", WiFi.SSID(i).c_str());
+                wifiScanList[i].channel = WiFi.channel(i);
             }
         }
     }
     WiFi.scanDelete();
 }
 
-static void onWiFiEvent(WiFiEvent_t event) {
+static void onWiFiEvent(WiFiEvent_t event, WiFiEventInfo_t info) {
     // callback to report on wifi events
     if (event == ARDUINO_EVENT_WIFI_READY)
         ;
@@ -232,6 +796,8 @@ static void onWiFiEvent(WiFiEvent_t event) {
                     WiFi.softAPSSID().c_str(),
                     WiFi.softAPIP().toString().c_str());
             AP_started = true;
+            setState(WFM_STATE_PORTAL_ACTIVE);
+            journal_add(WFM_EVENT_PORTAL_START, AP_channel);
 #if (WFM_AP_DNS_ENABLE)
             startDnsServer();
 #endif
@@ -244,16 +810,56 @@ static void onWiFiEvent(WiFiEvent_t event) {
             stopDnsServer();
 #endif
         }
-    } else if (event == ARDUINO_EVENT_WIFI_STA_GOT_IP)
+    } else if (event == ARDUINO_EVENT_WIFI_STA_GOT_IP) {
+        if (ipProbePending) {
+            // the address is not checked yet, the network is not ready
+            LOG_WRN("Wifi event: STA got IP %s during static IP check, ignored", WiFi.localIP().toString().c_str());
+            return;
+        }
+        if (leaseApplied && leaseDhcpStarted) {
+            // DHCP confirmed (or replaced) the applied lease, the network is already up
+            leaseGotIP();
+            if (wfmState == WFM_STATE_RECOVERING)
+                setState(WFM_STATE_CONNECTED);
+            return;
+        }
         LOG_INF("Wifi event: STA got IP, use 'http://%s' to connect", WiFi.localIP().toString().c_str());
-    else if (event == ARDUINO_EVENT_WIFI_STA_LOST_IP)
+        timeToIP = millis() - beginTime;
+        lastRSSI = WiFi.RSSI();
+        journal_add(WFM_EVENT_STA_GOT_IP, timeToIP);
+        LOG_INF("Wifi Station time to IP: %lu ms, lease cache mode: %d", (unsigned long)timeToIP, leaseMode);
+        if (leaseApplied)
+            leaseGotIP();
+        else if (!strlen(ST_ip))
+            saveLease();
+        setState(WFM_STATE_CONNECTED);
+        if (!firstPingOK) {
+            if (readyPolicy == WFM_READY_ON_GOT_IP)
+                fireReady();
+            else if (readyPolicy == WFM_READY_ON_GOT_IP_PROBE)
+                startProbe();
+        }
+    } else if (event == ARDUINO_EVENT_WIFI_STA_LOST_IP) {
         LOG_INF("Wifi event: STA lost IP");
+        if (wfmState == WFM_STATE_CONNECTED || wfmState == WFM_STATE_ONLINE)
+            setState(WFM_STATE_RECOVERING);
+    }
     else if (event == ARDUINO_EVENT_WIFI_AP_STAIPASSIGNED)
         ;
-    else if (event == ARDUINO_EVENT_WIFI_STA_CONNECTED)
-        LOG_INF("Wifi event: STA connection to %s", ST_ssid);
-    else if (event == ARDUINO_EVENT_WIFI_STA_DISCONNECTED)
-        LOG_INF("Wifi event: STA disconnected");
+    else if (event == ARDUINO_EVENT_WIFI_STA_CONNECTED) {
+        // in WIFI_AP_STA mode the radio follows the STA channel, keep AP there on the next start
+        AP_channel = WiFi.channel();
+        LOG_INF("Wifi event: STA connection to %s, channel %u", ST_ssid, AP_channel);
+        journal_add(WFM_EVENT_STA_CONNECTED, AP_channel);
+        if (ipProbePending)
+            staClearIP();  // DHCP client may be started on association
+    }
+    else if (event == ARDUINO_EVENT_WIFI_STA_DISCONNECTED) {
+        LOG_INF("Wifi event: STA disconnected, reason %u", info.wifi_sta_disconnected.reason);
+        journal_add(WFM_EVENT_STA_DISCONNECTED, info.wifi_sta_disconnected.reason);
+        if (wfmState == WFM_STATE_CONNECTED || wfmState == WFM_STATE_ONLINE)
+            setState(WFM_STATE_RECOVERING);
+    }
     else if (event == ARDUINO_EVENT_WIFI_AP_STACONNECTED)
         LOG_INF("Wifi event: AP client connection");
     else if (event == ARDUINO_EVENT_WIFI_AP_STADISCONNECTED)
@@ -265,7 +871,7 @@ static void onWiFiEvent(WiFiEvent_t event) {
 static bool setWifiAP() {
     if (!AP_started) {
         WiFi.mode(WIFI_AP_STA);
-        return WiFi.softAP(AP_ssid, AP_pswd, 1, AP_hidden, 1, false); // only 1 client
+        return WiFi.softAP(AP_ssid, AP_pswd, AP_channel, AP_hidden, AP_max_clients, false);
     }
     return false;
 }
@@ -277,29 +883,52 @@ static bool setWifiSTA() {
             WiFi.mode(WIFI_STA);
 
         if (strlen(ST_ip)) {
-            IPAddress _ip, _gw, _sn, _dns1, _dns2;
+            IPAddress _ip, _gw, _sn, _dns1;
             if (!_ip.fromString(ST_ip))
                 LOG_ERR("Failed to parse IP: %s", ST_ip);
             else {
-                _ip.fromString(ST_ip);
-                _gw.fromString(ST_gw);
-                _sn.fromString(ST_sn);
-                
-                if (strlen(ST_dns1)) {
-                    _dns1.fromString(ST_dns1);
+                parseStaticIP(_ip, _gw, _sn, _dns1);
+
+                if (ipStatus == WFM_IP_CONFLICT || ipStatus == WFM_IP_SUBNET_MISMATCH) {
+                    LOG_WRN("Wifi Station static IP rejected, IP from DHCP");
+                } else if ((uint32_t)_gw && (((uint32_t)_ip ^ (uint32_t)_gw) & (uint32_t)_sn)) {
+                    setIPStatus(WFM_IP_SUBNET_MISMATCH);
+                    WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE);  // DHCP
+                    LOG_ERR("Gateway %s is not in static IP subnet, IP from DHCP", ST_gw);
+                } else if (ipConflictCheck && !ipChecked) {
+                    // connect without IP (see WiFi.begin() below), startWifi() applies static IP after ARP probe
+                    ipProbePending = true;
+                    LOG_INF("Wifi Station check static IP");
                 } else {
-                    _dns1 = _gw;
+                    if (ipStatus == WFM_IP_STATIC_NEXT)
+                        _ip = IPAddress(ipCommitted);
+                    else if (ipStatus != WFM_IP_STATIC)
+                        setIPStatus(WFM_IP_STATIC);
+
+                    // set static ip
+                    WiFi.config(_ip, _gw, _sn, _dns1);  // need DNS for SNTP
+                    LOG_INF("Wifi Station set static IP");
                 }
-                _dns2.fromString(ST_dns2);
-
-                // set static ip
-                WiFi.config(_ip, _gw, _sn, _dns1);  // need DNS for SNTP
-                LOG_INF("Wifi Station set static IP");
             }
-        } else
+        } else if (leaseMode == WFM_LEASE_APPLY && ST_lease.ip && !leaseExpired()) {
+            WiFi.config(IPAddress(ST_lease.ip), IPAddress(ST_lease.gw), IPAddress(ST_lease.netmask), IPAddress(ST_lease.dns));
+            leaseApplied = true;
+            leaseDhcpStarted = false;
+            LOG_INF("Wifi Station set IP from DHCP lease cache");
+        } else {
+            if (leaseApplied) {
+                WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE);  // back to DHCP
+                leaseApplied = false;
+                leaseDhcpStarted = false;
+            }
             LOG_INF("Wifi Station IP from DHCP");
+        }
 
+        beginTime = millis();
         WiFi.begin(ST_ssid, ST_pswd);
+        // WiFi.begin() starts DHCP client if static IP is not set, the association is not done yet
+        if (ipProbePending)
+            staClearIP();
         return true;
     }
 
@@ -317,17 +946,21 @@ static bool startWifi(bool firstcall) {
         WiFi.disconnect(true);
         WiFi.setHostname(HostName);
         WiFi.onEvent(onWiFiEvent);
+        setState(strlen(ST_ssid) ? WFM_STATE_CONNECTING : WFM_STATE_IDLE);
     }
 
     bool station = setWifiSTA();
 
     if (station) {
         LOG_INF("check WiFi status");
-        uint32_t startAttemptTime = millis();
+        uint32_t waitTime = millis();
+        if (ipProbePending)
+            commitStaticIP(START_WIFI_WAIT_SEC * 1000);
+        waitTime = millis() - waitTime;
+        // wait for got IP (gateway is known for ping), the static IP check is in the same timeout
         // Stop trying on failure timeout, will try to reconnect later by ping
-        while (!WiFi.isConnected() && (millis() - startAttemptTime < START_WIFI_WAIT_SEC * 1000)) {
-            delay(500);
-        }
+        if (waitTime < START_WIFI_WAIT_SEC * 1000)
+            xEventGroupWaitBits(stateEventGroup, BIT(WFM_STATE_CONNECTED), pdFALSE, pdFALSE, pdMS_TO_TICKS(START_WIFI_WAIT_SEC * 1000 - waitTime));
 
 #if WFM_ST_MDNS_ENABLE
         if (firstcall) {
@@ -354,6 +987,7 @@ static bool startWifi(bool firstcall) {
 }
 
 static void pingSuccess(esp_ping_handle_t hdl, void *args) {
+    PROFILE_SCOPE(ping_ok);
     if (AP_started) {
         LOG_INF("pingSuccess: AP stop");
         stopCfgPortalServer();
@@ -361,18 +995,35 @@ static void pingSuccess(esp_ping_handle_t hdl, void *args) {
         WiFi.mode(WIFI_STA);
     }
 
-    if (!firstPingOK) {
-        firstPingOK = true;
-        if (onConnect_cb)
-            onConnect_cb();
-    }
+    setState(WFM_STATE_ONLINE);
+    lastRSSI = WiFi.RSSI();
+    backoff_check_reset();
+
+    if (probeDone)
+        stopProbe();
+
+    fireReady();
 
     if (onPingOK_cb)
         onPingOK_cb();
 }
 
 static void pingTimeout(esp_ping_handle_t hdl, void *args) {
-    LOG_WRN("Failed to ping gateway, restart wifi");
+    // spread the reconnection of many devices after the router restart
+    uint32_t delay_ms = backoff_next();
+    LOG_WRN("Failed to ping gateway, restart wifi in %lu ms", (unsigned long)delay_ms);
+    journal_add(WFM_EVENT_PING_TIMEOUT, (delay_ms + 99) / 100);
+    if (leaseApplied) {
+        LOG_WRN("DHCP lease cache rejected");
+        journal_add(WFM_EVENT_LEASE_REJECTED, 0);
+        memset(&ST_lease, 0, sizeof(ST_lease));  // next setWifiSTA() returns to DHCP
+    }
+    if (!AP_started)
+        setState(WFM_STATE_RECOVERING);
+    vTaskDelay(pdMS_TO_TICKS(delay_ms));
+
+    PROFILE_SCOPE(ping_err);  // after the backoff delay, it is not the handler execution time
+    reconnectTime = millis();
     startWifi(false);
 
     if (onPingERR_cb)
@@ -392,12 +1043,8 @@ static void startPing() {
     pingConfig.count = ESP_PING_COUNT_INFINITE;
     pingConfig.interval_ms = PING_INTERVAL_SEC * 1000;
     pingConfig.timeout_ms = 5000;
-#if CONFIG_IDF_TARGET_ESP32S3
-    pingConfig.task_stack_size = 1024 * 6;
-#else
-    pingConfig.task_stack_size = 1024 * 4;
-#endif
-    pingConfig.task_prio = 1;
+    pingConfig.task_stack_size = WFM_PING_STACK_SIZE;
+    pingConfig.task_prio = tasksCfg.ping.priority;  // esp_ping task has no core affinity
     // set ping task callback functions
     esp_ping_callbacks_t cbs;
     cbs.on_ping_success = pingSuccess;
@@ -409,6 +1056,51 @@ static void startPing() {
     LOG_INF("Started ping monitoring");
 }
 
+static void probeSuccess(esp_ping_handle_t hdl, void *args) {
+    PROFILE_SCOPE(probe);
+    setState(WFM_STATE_ONLINE);
+    fireReady();
+}
+
+static void probeEnd(esp_ping_handle_t hdl, void *args) {
+    probeDone = true;
+}
+
+static void stopProbe() {
+    if (probeHandle) {
+        esp_ping_stop(probeHandle);
+        esp_ping_delete_session(probeHandle);
+        probeHandle = NULL;
+    }
+    probeDone = false;
+}
+
+/**
+ * Immediate one-shot gateway ping, if failed - wait for the regular ping
+ */
+static void startProbe() {
+    stopProbe();
+
+    IPAddress ipAddr = WiFi.gatewayIP();
+    ip_addr_t pingDest;
+    IP_ADDR4(&pingDest, ipAddr[0], ipAddr[1], ipAddr[2], ipAddr[3]);
+    esp_ping_config_t pingConfig = ESP_PING_DEFAULT_CONFIG();
+    pingConfig.target_addr = pingDest;
+    pingConfig.count = 1;
+    pingConfig.timeout_ms = 1000;
+    pingConfig.task_stack_size = WFM_PING_STACK_SIZE;
+    pingConfig.task_prio = tasksCfg.ping.priority;  // esp_ping task has no core affinity
+    esp_ping_callbacks_t cbs;
+    cbs.on_ping_success = probeSuccess;
+    cbs.on_ping_timeout = NULL;
+    cbs.on_ping_end = probeEnd;
+    cbs.cb_args = NULL;
+    if (esp_ping_new_session(&pingConfig, &cbs, &probeHandle) == ESP_OK) {
+        esp_ping_start(probeHandle);
+        LOG_INF("Started gateway probe");
+    }
+}
+
 static void stopPing() {
     if (pingHandle) {
         esp_ping_stop(pingHandle);
@@ -423,7 +1115,7 @@ const char head_chunk_html[] = R"rawliteral(<!DOCTYPE HTML><html lang="en">
 <meta name="viewport" content="width=device-width, initial-scale=1">
 <title>WiFi settings</title>
 <style>
-input[type="text"] {width:250px;margin-bottom:8px;font-size:20px;}
+input[type="text"],input[type="number"] {width:250px;margin-bottom:8px;font-size:20px;}
 input[type="submit"] {width:250px;height:60px;margin-bottom:8px;font-size:20px;}
 select {width:50px;font-size:20px;}
 body {text-align:center;font-size:15px;}
@@ -432,45 +1124,283 @@ body {text-align:center;font-size:15px;}
 const char end_chunk_html[] = R"rawliteral(</body></html>)rawliteral";
 
 const char cfg_portal_body_begin[] = R"rawliteral(<form action="/" method="POST">
-<input type="text" name="ssid" id="ssid" placeholder="SSID" required maxlength="32" style="width:200px;">
+<input type="text" name="ssid" id="ssid" value=")rawliteral";
+
+const char cfg_portal_body_ssid[] = R"rawliteral(" placeholder="SSID" required maxlength="32" style="width:200px;">
 <select onchange="document.getElementById('ssid').value=this.options[this.selectedIndex].text;this.selectedIndex=0">
 <option selected>&nbsp;</option>)rawliteral";
 
-const char cfg_portal_body_end[] = R"rawliteral(</select><br>
-<input type="text" name="pswd" placeholder="Pass" maxlength="64"><br>
-<input type="submit" value="Check Connection">
+const char cfg_portal_body_pswd[] = R"rawliteral(</select><br>
+<input type="text" name="pswd" placeholder="Pass" maxlength="64"><br>)rawliteral";
+
+const char cfg_portal_body_end[] = R"rawliteral(<input type="submit" value="Check Connection">
 </form>)rawliteral";
 
-static esp_err_t indexHandler(httpd_req_t *req) {
+#pragma region "Page template"
+
+#define PAGE_BUF_SIZE 256
+
+// collects small writes into one chunk, big static segments are sent directly
+typedef struct {
+    httpd_req_t *req;
+    const void *ctx;  // page data for the fields, can be NULL
+    size_t len;
+    char buf[PAGE_BUF_SIZE];
+} page_writer_t;
+
+typedef void (*page_field_fn_t)(page_writer_t *pw);
+
+typedef struct {
+    const char *text;       // static segment
+    size_t len;             // static segment length, known at compile time
+    page_field_fn_t field;  // dynamic value after the segment, can be NULL
+} page_segment_t;
+
+#define PAGE_SEGMENT(literal, field) {literal, sizeof(literal) - 1, field}
+
+static void page_flush(page_writer_t *pw) {
+    if (pw->len) {
+        httpd_resp_send_chunk(pw->req, pw->buf, pw->len);
+        pw->len = 0;
+    }
+}
+
+static void page_write(page_writer_t *pw, const char *str, size_t len) {
+    if (pw->len + len > sizeof(pw->buf)) {
+        page_flush(pw);
+        if (len > sizeof(pw->buf)) {
+            httpd_resp_send_chunk(pw->req, str, len);
+            return;
+        }
+    }
+    memcpy(pw->buf + pw->len, str, len);
+    pw->len += len;
+}
+
+static void page_write_str(page_writer_t *pw, const char *str) {
+    page_write(pw, str, strlen(str));
+}
+
+static void page_write_html(page_writer_t *pw, const char *str) {
+    for (; *str; ++str) {
+        switch (*str) {
+            case '&': page_write_str(pw, "&amp;"); break;
+            case '<': page_write_str(pw, "&lt;"); break;
+            case '>': page_write_str(pw, "&gt;"); break;
+            case '"': page_write_str(pw, "&quot;"); break;
+            case '\'': page_write_str(pw, "&#39;"); break;
+            default: page_write(pw, str, 1); break;
+        }
+    }
+}
+
+static void page_write_int(page_writer_t *pw, int32_t value) {
+    char buf[12];
+    page_write(pw, buf, snprintf(buf, sizeof(buf), "%ld", (long)value));
+}
+
+static esp_err_t page_render(httpd_req_t *req, const page_segment_t *page, size_t cnt, const void *ctx) {
+    page_writer_t pw;
+    pw.req = req;
+    pw.ctx = ctx;
+    pw.len = 0;
+
     httpd_resp_set_type(req, "text/html");
-    httpd_resp_sendstr_chunk(req, head_chunk_html);
-    httpd_resp_sendstr_chunk(req, cfg_portal_body_begin);
+    for (size_t i = 0; i < cnt; ++i) {
+        page_write(&pw, page[i].text, page[i].len);
+        if (page[i].field)
+            page[i].field(&pw);
+    }
+    page_flush(&pw);
+    return httpd_resp_send_chunk(req, NULL, 0); // Send empty chunk to signal HTTP response completion
+}
+
+#pragma endregion
 
-    if (wifiScanList) {
-        char *pwifiScanList = wifiScanList;
-        for (uint8_t i = 0; i < wifiScanListCnt; ++i) {
-            httpd_resp_sendstr_chunk(req, "<option>");
-            httpd_resp_sendstr_chunk(req, pwifiScanList);
-            httpd_resp_sendstr_chunk(req, "</option>");
-            pwifiScanList += sizeof(AP_ssid);
+// submitted configuration form, shown again on error
+typedef struct {
+    const char *error;           // error text
+    const wifi_param_t *param;   // invalid parameter, can be NULL
+    const char *ssid;            // submitted decoded SSID, can be NULL
+    char *const *values;         // submitted decoded parameter values, items can be NULL
+} cfg_form_t;
+
+static void page_error(page_writer_t *pw) {
+    const cfg_form_t *form = (const cfg_form_t *)pw->ctx;
+    if (!form)
+        return;
+
+    page_write_str(pw, R"~(<p style="color:red;">)~");
+    page_write_html(pw, form->error);
+    if (form->param) {
+        page_write_str(pw, ": ");
+        page_write_html(pw, form->param->label);
+        if (form->param->is_int) {
+            page_write_str(pw, " (");
+            page_write_int(pw, form->param->min);
+            page_write_str(pw, "..");
+            page_write_int(pw, form->param->max);
+            page_write_str(pw, ")");
         }
     }
+    page_write_str(pw, "</p>");
+}
 
-    httpd_resp_sendstr_chunk(req, cfg_portal_body_end);
-    httpd_resp_sendstr_chunk(req, end_chunk_html);
-    return httpd_resp_sendstr_chunk(req, NULL); // Send empty chunk to signal HTTP response completion
+static void page_ssid(page_writer_t *pw) {
+    const cfg_form_t *form = (const cfg_form_t *)pw->ctx;
+    if (form && form->ssid)
+        page_write_html(pw, form->ssid);
 }
 
-static esp_err_t cfgHandler(httpd_req_t *req) {
-    const char ssid_str[] = "ssid=";
-    const char pswd_str[] = "&pswd=";
+static void page_scan_list(page_writer_t *pw) {
+    for (uint8_t i = 0; i < wifiScanListCnt; ++i) {
+        page_write_str(pw, "<option>");
+        page_write_html(pw, wifiScanList[i].ssid);
+        page_write_str(pw, "</option>");
+    }
+}
+
+static void page_params(page_writer_t *pw) {
+    const cfg_form_t *form = (const cfg_form_t *)pw->ctx;
+    for (uint8_t i = 0; i < paramsCnt; ++i) {
+        const wifi_param_t *param = &params[i];
+        // submitted value if the form is shown again, else stored value
+        const char *value = (form && form->values && form->values[i]) ? form->values[i] : NULL;
+        page_write_str(pw, "<label>");
+        page_write_html(pw, param->label);
+        page_write_str(pw, param->is_int ? R"~(<br><input type="number" required name=")~" : R"~(<br><input type="text" name=")~");
+        page_write_str(pw, param->id);
+        if (param->is_int) {
+            page_write_str(pw, R"~(" min=")~");
+            page_write_int(pw, param->min);
+            page_write_str(pw, R"~(" max=")~");
+            page_write_int(pw, param->max);
+            page_write_str(pw, R"~(" value=")~");
+            if (value)
+                page_write_html(pw, value);
+            else
+                page_write_int(pw, *(int32_t *)param->value);
+        } else {
+            page_write_str(pw, R"~(" maxlength=")~");
+            page_write_int(pw, param->max);
+            page_write_str(pw, R"~(" value=")~");
+            page_write_html(pw, value ? value : (char *)param->value);
+        }
+        page_write_str(pw, R"~("></label><br>)~");
+    }
+}
+
+static const page_segment_t cfg_portal_page[] = {
+    PAGE_SEGMENT(head_chunk_html, page_error),
+    PAGE_SEGMENT(cfg_portal_body_begin, page_ssid),
+    PAGE_SEGMENT(cfg_portal_body_ssid, page_scan_list),
+    PAGE_SEGMENT(cfg_portal_body_pswd, page_params),
+    PAGE_SEGMENT(cfg_portal_body_end, NULL),
+    PAGE_SEGMENT(end_chunk_html, NULL),
+};
+
+static esp_err_t indexHandler(httpd_req_t *req) {
+    PROFILE_SCOPE(index);
+    return page_render(req, cfg_portal_page, sizeof(cfg_portal_page) / sizeof(cfg_portal_page[0]), NULL);
+}
+
+// OS connectivity check URIs, answered by the immediate redirect to the portal
+static const char *const captive_probe_uris[] = {
+    "/generate_204",               // Android, ChromeOS
+    "/gen_204",                    // Android
+    "/hotspot-detect.html",        // iOS, macOS
+    "/library/test/success.html",  // iOS (old)
+    "/connecttest.txt",            // Windows 10+
+    "/ncsi.txt",                   // Windows 7/8
+    "/redirect",                   // Windows
+    "/success.txt",                // Firefox
+    "/canonical.html",             // Ubuntu
+};
+
+const char captive_redirect_html[] = R"rawliteral(<a href="/">WiFi settings</a>)rawliteral";
+
+static char cfgPortalUrl[24] = "";  // "http://%AP_IP%/"
+
+static bool isCaptiveProbe(const char *uri) {
+    for (uint8_t i = 0; i < sizeof(captive_probe_uris) / sizeof(captive_probe_uris[0]); ++i) {
+        size_t len = strlen(captive_probe_uris[i]);
+        if (!strncmp(uri, captive_probe_uris[i], len) && (uri[len] == '\0' || uri[len] == '?'))
+            return true;
+    }
+    return false;
+}
+
+static esp_err_t captiveHandler(httpd_req_t *req) {
+    httpd_resp_set_status(req, "302 Found");
+    httpd_resp_set_hdr(req, "Location", cfgPortalUrl);
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+
+    if (isCaptiveProbe(req->uri)) {
+        LOG_INF("captive probe: %s", req->uri);
+        return httpd_resp_send(req, NULL, 0);  // OS probe doesn't need a body
+    }
+
+    httpd_resp_set_type(req, "text/html");
+    return httpd_resp_send(req, captive_redirect_html, sizeof(captive_redirect_html) - 1);
+}
+
+/**
+ * Url-encoded form field value, form fields must be split by '\0'
+ * @return pointer to value or NULL if not found
+ */
+static const char *form_value(const char *form, size_t form_len, const char *name) {
+    size_t name_len = strlen(name);
+    for (const char *field = form; field < form + form_len; field += strlen(field) + 1) {
+        if (!strncmp(field, name, name_len) && field[name_len] == '=')
+            return field + name_len + 1;
+    }
+    return NULL;
+}
 
-    const uint16_t buf_len = 
-        (MAX_SSID_SIZE + MAX_PSWD_SIZE) * 3 // url encoded: '?' = "%3F"
-        + sizeof(pswd_str) + sizeof(ssid_str)
-        + 10; // gap
+/**
+ * Decode and check user parameters of the form
+ * @param decoded decoded text values, free() after use
+ * @param ints int values
+ * @return index of the first invalid parameter, -1 if all parameters are valid
+ */
+static int8_t form_params(const char *form, size_t form_len, char **decoded, int32_t *ints) {
+    int8_t invalid = -1;
+    for (uint8_t i = 0; i < paramsCnt; ++i) {
+        const wifi_param_t *param = &params[i];
+        const char *value = form_value(form, form_len, param->id);
+        bool valid = true;
+        decoded[i] = WiFiManagerClass::url_decode(value ? value : "");
+        if (!decoded[i]) {
+            valid = false;
+        } else if (param->is_int) {
+            char *end;
+            long val = strtol(decoded[i], &end, 10);
+            if (!*decoded[i] || *end || val < param->min || val > param->max)
+                valid = false;
+            ints[i] = val;
+        } else if (strlen(decoded[i]) > (size_t)param->max) {
+            valid = false;
+        }
+        if (!valid && invalid < 0)
+            invalid = i;
+    }
+    return invalid;
+}
 
-    char buf[buf_len];
+static esp_err_t faviconHandler(httpd_req_t *req) {
+    httpd_resp_set_status(req, "204 No Content");
+    httpd_resp_set_hdr(req, "Cache-Control", "max-age=86400");
+    return httpd_resp_send(req, NULL, 0);
+}
+
+// url encoded form "ssid=...&pswd=...&id=...", '?' = "%3F", int value is shorter than text one
+#define CFG_FORM_MAX_LEN ((MAX_SSID_SIZE + MAX_PSWD_SIZE) * 3 + sizeof("ssid=&pswd=") + \
+                          WFM_MAX_PARAMS * (MAX_PARAM_ID_SIZE + 2 + MAX_PARAM_TEXT_SIZE * 3) + 10)
+
+static esp_err_t cfgHandler(httpd_req_t *req) {
+    PROFILE_SCOPE(cfg);
+    // handlers run one at a time in the httpd task, keep the form off its stack
+    static char buf[CFG_FORM_MAX_LEN];
 
     size_t total_len = req->content_len;
     size_t received = 0;
@@ -492,94 +1422,148 @@ static esp_err_t cfgHandler(httpd_req_t *req) {
 
     buf[total_len] = '\0';
 
-    char *ssid = strstr(buf, ssid_str);
-    char *pswd = strstr(buf, pswd_str);
+    // split fields "ssid=...&pswd=...&id=..."
+    for (char *p = buf; *p; ++p) {
+        if (*p == '&')
+            *p = '\0';
+    }
 
-    if (ssid && pswd) {
-        char *pswd_decode = WiFiManagerClass::url_decode(pswd + sizeof(pswd_str) - 1);
-        *pswd = '\0';
+    const char *ssid = form_value(buf, total_len, "ssid");
+    const char *pswd = form_value(buf, total_len, "pswd");
 
-        char *ssid_decode = WiFiManagerClass::url_decode(ssid + sizeof(ssid_str) - 1);
+    if (!ssid || !pswd)
+        return indexHandler(req);
 
-        size_t ssid_decode_len = strlen(ssid_decode);
-        size_t pswd_decode_len = strlen(pswd_decode);
+    char *pswd_decode = WiFiManagerClass::url_decode(pswd);
+    char *ssid_decode = WiFiManagerClass::url_decode(ssid);
 
-        if ((ssid_decode_len <= MAX_SSID_SIZE) && (pswd_decode_len <= MAX_PSWD_SIZE)) {
-            
-            LOG_INF(R"~(Check connection to SSID="%s", Pass="%s")~", ssid_decode, pswd_decode);
-            
-            stopPing();
-            WiFi.disconnect(true);
-            WiFi.begin(ssid_decode, pswd_decode);
+    char *params_decode[WFM_MAX_PARAMS] = {};
+    int32_t params_int[WFM_MAX_PARAMS] = {};
+    int8_t params_invalid = form_params(buf, total_len, params_decode, params_int);
 
-            uint32_t startAttemptTime = millis();
-            while (!WiFi.isConnected() && millis() - startAttemptTime < 5000) {
-                delay(500);
-            }
+    size_t ssid_decode_len = strlen(ssid_decode);
+    size_t pswd_decode_len = strlen(pswd_decode);
 
-            if (WiFi.isConnected()) {
-                httpd_resp_set_hdr(req, "Connection", "close");
-                httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
-                httpd_resp_set_type(req, "text/html");
-                httpd_resp_sendstr_chunk(req, head_chunk_html);
-                httpd_resp_sendstr_chunk(req, "Connection OK.<br>System Restart now...");
+    cfg_form_t form = {};
+    form.ssid = ssid_decode;
+    form.values = params_decode;
 
-                if (strlen(ST_ip)) {
-                    snprintf(buf, sizeof(buf) - 1, R"~(<a href="http://%s"><br>Try http://%s later</a>)~", ST_ip, ST_ip);
-                    httpd_resp_sendstr_chunk(req, buf);
-                }
+    if ((ssid_decode_len > MAX_SSID_SIZE) || (pswd_decode_len > MAX_PSWD_SIZE)) {
+        form.error = "SSID or password is too long";
+    } else if (params_invalid >= 0) {
+        form.error = "Invalid value";
+        form.param = &params[params_invalid];
+    } else {
+        LOG_INF(R"~(Check connection to SSID="%s", Pass="%s")~", ssid_decode, pswd_decode);
 
-                httpd_resp_sendstr_chunk(req, end_chunk_html);
-                httpd_resp_sendstr_chunk(req, NULL);
+        stopPing();
+        WiFi.disconnect(true);
+        // the cached lease belongs to the old network, check the new one with DHCP
+        if (strcmp(ssid_decode, ST_ssid))
+            memset(&ST_lease, 0, sizeof(ST_lease));
+        if (leaseApplied) {
+            WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE);
+            leaseApplied = false;
+            leaseDhcpStarted = false;
+        }
+        // the known channel skips the full scan and keeps the radio (and AP client) on one channel
+        WiFi.begin(ssid_decode, pswd_decode, wifi_scan_channel(ssid_decode));
 
-                memcpy(ST_ssid, ssid_decode, ssid_decode_len + 1);
-                memcpy(ST_pswd, pswd_decode, pswd_decode_len + 1);
-                memcpy(ST_gw, WiFi.gatewayIP().toString().c_str(), sizeof(ST_gw));
+        uint32_t startAttemptTime = millis();
+        while (!WiFi.isConnected() && millis() - startAttemptTime < 5000) {
+            delay(500);
+        }
 
-                saveWiFiAuthData();
+        if (WiFi.isConnected()) {
+            httpd_resp_set_hdr(req, "Connection", "close");
+            httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+            httpd_resp_set_type(req, "text/html");
+            httpd_resp_sendstr_chunk(req, head_chunk_html);
+            httpd_resp_sendstr_chunk(req, "Connection OK.<br>System Restart now...");
 
-                free(ssid_decode);
-                free(pswd_decode);
+            if (strlen(ST_ip)) {
+                snprintf(buf, sizeof(buf) - 1, R"~(<a href="http://%s"><br>Try http://%s later</a>)~", ST_ip, ST_ip);
+                httpd_resp_sendstr_chunk(req, buf);
+            }
+
+            httpd_resp_sendstr_chunk(req, end_chunk_html);
+            httpd_resp_sendstr_chunk(req, NULL);
 
-                LOG_INF("restart");
-                Serial.flush();
-                delay(500);
-                ESP.restart();
+            memcpy(ST_ssid, ssid_decode, ssid_decode_len + 1);
+            memcpy(ST_pswd, pswd_decode, pswd_decode_len + 1);
+            memcpy(ST_gw, WiFi.gatewayIP().toString().c_str(), sizeof(ST_gw));
 
-                return ESP_OK;
+            for (uint8_t i = 0; i < paramsCnt; ++i) {
+                if (params[i].is_int)
+                    *(int32_t *)params[i].value = params_int[i];
+                else
+                    memcpy(params[i].value, params_decode[i], strlen(params_decode[i]) + 1);
+                free(params_decode[i]);
             }
+
+            // WiFi settings and user parameters in one NVS commit
+            saveWiFiAuthData();
+
+            free(ssid_decode);
+            free(pswd_decode);
+
+            LOG_INF("restart");
+            journal_add(WFM_EVENT_CFG_RESTART, 0);
+            PROFILE_SCOPE_END();
+            Serial.flush();
+            delay(500);
+            ESP.restart();
+
+            return ESP_OK;
         }
 
-        free(ssid_decode);
-        free(pswd_decode);
+        form.error = "Connection failed";
     }
 
-    return indexHandler(req);
+    // show the submitted values with the error
+    esp_err_t ret = page_render(req, cfg_portal_page, sizeof(cfg_portal_page) / sizeof(cfg_portal_page[0]), &form);
+
+    for (uint8_t i = 0; i < paramsCnt; ++i)
+        free(params_decode[i]);
+
+    free(ssid_decode);
+    free(pswd_decode);
+
+    return ret;
 }
 
 static void startCfgPortalServer() {
 
     const uint8_t WEB_PORT = 80;
-    const uint8_t MAX_CLIENTS = 1;
 
     if (cfgPortalHttpServer)
         return;
 
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
-#if CONFIG_IDF_TARGET_ESP32S3
-    config.stack_size = 1024 * 8;
-#endif
+    config.stack_size = WFM_HTTPD_STACK_SIZE;
+    config.task_priority = tasksCfg.httpd.priority;
+    config.core_id = taskCore(&tasksCfg.httpd);
     config.server_port = WEB_PORT;
     config.ctrl_port = WEB_PORT;
+    // HTTP keep-alive sockets, the least recently used one is closed if there is no free socket
     config.lru_purge_enable = true;
-    config.max_open_sockets = MAX_CLIENTS;
+    config.max_open_sockets = WFM_PORTAL_MAX_SOCKETS;
+    config.max_uri_handlers = 4;                     // index, cfg, favicon, captive
+    config.uri_match_fn = httpd_uri_match_wildcard;  // exact "/" is matched first, then "/*"
 
+    snprintf(cfgPortalUrl, sizeof(cfgPortalUrl), "http://%s/", WiFi.softAPIP().toString().c_str());
+
+    // the order of registration is important: wildcard handler must be the last
     httpd_uri_t indexUri = {.uri = "/", .method = HTTP_GET, .handler = indexHandler, .user_ctx = NULL};
     httpd_uri_t cfgUri = {.uri = "/", .method = HTTP_POST, .handler = cfgHandler, .user_ctx = NULL};
+    httpd_uri_t faviconUri = {.uri = "/favicon.ico", .method = HTTP_GET, .handler = faviconHandler, .user_ctx = NULL};
+    httpd_uri_t captiveUri = {.uri = "/*", .method = HTTP_GET, .handler = captiveHandler, .user_ctx = NULL};
     
     if (httpd_start(&cfgPortalHttpServer, &config) == ESP_OK) {
         httpd_register_uri_handler(cfgPortalHttpServer, &indexUri);
         httpd_register_uri_handler(cfgPortalHttpServer, &cfgUri);
+        httpd_register_uri_handler(cfgPortalHttpServer, &faviconUri);
+        httpd_register_uri_handler(cfgPortalHttpServer, &captiveUri);
         LOG_INF("start cfgPortalHttpServer on port: %u", config.server_port);
     } else {
         LOG_ERR("Failed to start web server");
@@ -598,7 +1582,18 @@ static void stopCfgPortalServer() {
 ////////////////////////////////////////////////////////////
 
 WiFiManagerClass::WiFiManagerClass() {
-    snprintf(AP_ssid, sizeof(AP_ssid), "ESP_%04X", (uint16_t)ESP.getEfuseMac());
+    journal_init();
+    journal_add(WFM_EVENT_BOOT, esp_reset_reason());
+
+    uint64_t mac = ESP.getEfuseMac();
+    // different reconnect delays on different devices, xorshift32 state must not be 0
+    uint32_t seed = (uint32_t)(mac ^ (mac >> 32));
+    backoffRng = seed ? seed : 1;
+
+    stateEventGroup = xEventGroupCreateStatic(&stateEventGroupBuf);
+    stateMutex = xSemaphoreCreateMutexStatic(&stateMutexBuf);
+    xEventGroupSetBits(stateEventGroup, stateBits(WFM_STATE_IDLE));
+    snprintf(AP_ssid, sizeof(AP_ssid), "ESP_%04X", (uint16_t)mac);
     snprintf(HostName, sizeof(HostName), "%s", AP_ssid);
     loadWiFiAuthData();
 }
@@ -627,6 +1622,10 @@ void WiFiManagerClass::setStaticIP(const char *ip, const char *subnet, const cha
     if (dns2)
         snprintf(ST_dns2, sizeof(ST_dns2), "%s", dns2);
 
+    // check the new address
+    ipStatus = WFM_IP_DHCP;
+    ipChecked = false;
+
     // restart if needed
     if (pingHandle) {
         stopPing();
@@ -634,13 +1633,54 @@ void WiFiManagerClass::setStaticIP(const char *ip, const char *subnet, const cha
     }
 }
 
+static bool checkTaskCfg(const wfm_task_cfg_t *cfg) {
+    return cfg->core < portNUM_PROCESSORS && cfg->priority < configMAX_PRIORITIES;
+}
+
+/**
+ * Library tasks core affinity and priority (call before start, applied to the tasks created later).
+ * Pin the library to PRO_CPU (core = 0) to keep the Arduino loop() core free.
+ * @param cfg DNS server, ping and configuration portal tasks settings
+ */
+void WiFiManagerClass::setTasksConfig(const wfm_tasks_cfg_t *cfg) {
+    if (!checkTaskCfg(&cfg->dns) || !checkTaskCfg(&cfg->ping) || !checkTaskCfg(&cfg->httpd)) {
+        LOG_ERR("Wrong tasks config");
+        return;
+    }
+    if (cfg->ping.core >= 0) {
+        LOG_WRN("Ping task core affinity is not supported, ignored");
+    }
+    tasksCfg = *cfg;
+}
+
+/**
+ * Static IP conflict detection (enabled by default, call before start).
+ * On the first connection the static IP is checked by ARP probe (RFC 5227) before use.
+ * @param enable ARP probe of static IP
+ * @param fallback WFM_IP_FALLBACK_DHCP or WFM_IP_FALLBACK_NEXT_FREE if the address is used by another host
+ */
+void WiFiManagerClass::setIPConflictCheck(bool enable, wfm_ip_fallback_t fallback) {
+    ipConflictCheck = enable;
+    ipFallback = fallback;
+}
+
+/**
+ * Static IP check result
+ * @return WFM_IP_DHCP if static IP is not set (or not checked yet), WFM_IP_STATIC if applied,
+ * WFM_IP_STATIC_NEXT, WFM_IP_CONFLICT, WFM_IP_SUBNET_MISMATCH or WFM_IP_STATIC_UNCHECKED
+ */
+wfm_ip_status_t WiFiManagerClass::getIPStatus() {
+    return ipStatus;
+}
+
 /**
  * Access Point configuration.
  * @param ssidAP Access Point SSID (if null - use the default name "ESP_XXXX", where XXXX is the end MAC-address of the device)
  * @param passwordAP Access Point password (if null - use the blank password)
  * @param hidden Access Point hidden
+ * @param maxClients max stations connected to Access Point (1..10)
  */
-void WiFiManagerClass::configAP(const char *ssidAP, const char *passwordAP, bool hidden) {
+void WiFiManagerClass::configAP(const char *ssidAP, const char *passwordAP, bool hidden, uint8_t maxClients) {
     if (ssidAP)
         snprintf(AP_ssid, sizeof(AP_ssid), "%s", ssidAP);
 
@@ -654,6 +1694,93 @@ void WiFiManagerClass::configAP(const char *ssidAP, const char *passwordAP, bool
     }
 
     AP_hidden = hidden;
+
+    if (maxClients < 1 || maxClients > 10) {
+        LOG_WRN("maxClients must be 1..10. Apply 1");
+        maxClients = 1;
+    }
+    AP_max_clients = maxClients;
+}
+
+static bool addParam(const char *id, const char *label, void *value, int32_t min, int32_t max, bool is_int) {
+    const char *reserved[] = {"ssid", "pswd", "gateway", "lease"};
+
+    if (paramsCnt >= WFM_MAX_PARAMS || !id || !value || !strlen(id) || strlen(id) > MAX_PARAM_ID_SIZE || min > max) {
+        LOG_ERR("Failed to add parameter: %s", id ? id : "");
+        return false;
+    }
+
+    for (uint8_t i = 0; i < sizeof(reserved) / sizeof(reserved[0]); ++i) {
+        if (!strcmp(id, reserved[i])) {
+            LOG_ERR("Parameter id is reserved: %s", id);
+            return false;
+        }
+    }
+
+    // the id is the form field name and the NVS key
+    for (uint8_t i = 0; i < paramsCnt; ++i) {
+        if (!strcmp(id, params[i].id)) {
+            LOG_ERR("Parameter id is already added: %s", id);
+            return false;
+        }
+    }
+
+    wifi_param_t *param = &params[paramsCnt];
+    param->id = id;
+    param->label = label ? label : id;
+    param->value = value;
+    param->min = min;
+    param->max = max;
+    param->is_int = is_int;
+
+    // load saved value
+    nvs_handle_t nvs_handle;
+    if (nvs_open("wifiAuthData", NVS_READONLY, &nvs_handle) == ESP_OK) {
+        if (is_int) {
+            int32_t val;
+            if (nvs_get_i32(nvs_handle, id, &val) == ESP_OK && val >= min && val <= max)
+                *(int32_t *)value = val;
+        } else {
+            size_t nvs_required_size;
+            if (nvs_get_str(nvs_handle, id, NULL, &nvs_required_size) == ESP_OK && nvs_required_size <= (size_t)max + 1)
+                nvs_get_str(nvs_handle, id, (char *)value, &nvs_required_size);
+        }
+        nvs_close(nvs_handle);
+    }
+
+    paramsCnt++;
+    return true;
+}
+
+/**
+ * Add the user text parameter to the configuration portal.
+ * The value is loaded from NVS now and saved together with WiFi settings.
+ * @param id field name and NVS key (max 15 characters), static string
+ * @param label field label, static string
+ * @param value buffer with the default value, must be valid while WiFiManager is used
+ * @param size buffer size (max length + 1, max 65)
+ * @return false if the parameter can't be added
+ */
+bool WiFiManagerClass::addParameter(const char *id, const char *label, char *value, size_t size) {
+    if (size < 2 || size > MAX_PARAM_TEXT_SIZE + 1) {
+        LOG_ERR("Wrong parameter size: %s", id ? id : "");
+        return false;
+    }
+    return addParam(id, label, value, 0, size - 1, false);
+}
+
+/**
+ * Add the user integer parameter to the configuration portal.
+ * The value is loaded from NVS now and saved together with WiFi settings.
+ * @param id field name and NVS key (max 15 characters), static string
+ * @param label field label, static string
+ * @param value variable with the default value, must be valid while WiFiManager is used
+ * @param min min allowed value
+ * @param max max allowed value
+ * @return false if the parameter can't be added
+ */
+bool WiFiManagerClass::addParameter(const char *id, const char *label, int32_t *value, int32_t min, int32_t max) {
+    return addParam(id, label, value, min, max, true);
 }
 
 /**
@@ -666,6 +1793,7 @@ bool WiFiManagerClass::start(const char *hostname) {
         snprintf(HostName, sizeof(HostName), "%s", hostname);
     else
         snprintf(HostName, sizeof(HostName), "%s", AP_ssid);
+    startTime = millis();
     return startWifi(true);
 }
 
@@ -677,6 +1805,35 @@ bool WiFiManagerClass::isConnected() {
     return WiFi.isConnected();
 }
 
+/**
+ * Current connection state (no WiFi driver call)
+ * @return WiFiManager state
+ */
+wfm_state_t WiFiManagerClass::getState() {
+    return wfmState;
+}
+
+/**
+ * Block the calling task until the state is reached, without polling.
+ * Waiting for WFM_STATE_CONNECTED also returns in the WFM_STATE_ONLINE state.
+ * @param state expected state
+ * @param timeoutMs wait timeout, ms
+ * @return true if the state is reached before timeout
+ */
+bool WiFiManagerClass::waitForState(wfm_state_t state, uint32_t timeoutMs) {
+    const EventBits_t bit = BIT(state);
+    return xEventGroupWaitBits(stateEventGroup, bit, pdFALSE, pdFALSE, pdMS_TO_TICKS(timeoutMs)) & bit;
+}
+
+/**
+ * State generation counter, incremented on each state change.
+ * Compare with the previously saved value to detect a change cheaply.
+ * @return state generation
+ */
+uint32_t WiFiManagerClass::getStateGeneration() {
+    return wfmStateGen;
+}
+
 /**
  * Attach user callback function to first successful connection event
  */
@@ -684,6 +1841,39 @@ void WiFiManagerClass::attachOnFirstConnect(callback_fn_t callback_fn) {
     onConnect_cb = callback_fn;
 }
 
+/**
+ * When to fire the first successful connection event (call before start)
+ * @param policy WFM_READY_ON_PING (default), WFM_READY_ON_GOT_IP or WFM_READY_ON_GOT_IP_PROBE
+ */
+void WiFiManagerClass::setReadyPolicy(wfm_ready_policy_t policy) {
+    readyPolicy = policy;
+}
+
+/**
+ * Reconnect delay after the gateway ping timeout (decorrelated jittered exponential backoff)
+ * @param baseMs min delay, ms (default 1000, min 1)
+ * @param capMs max delay, ms (default 60000)
+ * @param resetMs stable connection time to return to the min delay, ms (default 300000)
+ */
+void WiFiManagerClass::setReconnectBackoff(uint32_t baseMs, uint32_t capMs, uint32_t resetMs) {
+    if (baseMs < 1)
+        baseMs = 1;  // 0 is the reset value of the current delay
+    if (capMs < baseMs)
+        capMs = baseMs;
+    backoffBaseMs = baseMs;
+    backoffCapMs = capMs;
+    backoffResetMs = resetMs;
+    backoffDelayMs = 0;
+}
+
+/**
+ * Time from start() to the first successful connection event
+ * @return time in ms, 0 if the event has not fired yet
+ */
+uint32_t WiFiManagerClass::getReadyTime() {
+    return readyTime;
+}
+
 /**
  * Attach user callback function to ping success event
  */
@@ -699,12 +1889,111 @@ void WiFiManagerClass::attachOnPingERR(callback_fn_t callback_fn) {
 }
 
 /**
- * Clean stored WiFi settings (ssid, password, gateway(router) IP)
+ * Use the last DHCP lease to speed up getting IP after reboot (call before start).
+ * Not used with static IP. WFM_LEASE_REBOOT is done by ESP-IDF, it needs CONFIG_LWIP_DHCP_RESTORE_LAST_IP.
+ * @param mode WFM_LEASE_OFF (default), WFM_LEASE_REBOOT or WFM_LEASE_APPLY
+ */
+void WiFiManagerClass::setLeaseCache(wfm_lease_mode_t mode) {
+#if !CONFIG_LWIP_DHCP_RESTORE_LAST_IP
+    if (mode == WFM_LEASE_REBOOT) {
+        LOG_WRN("WFM_LEASE_REBOOT needs CONFIG_LWIP_DHCP_RESTORE_LAST_IP, full DHCP exchange is used");
+    }
+#endif
+    leaseMode = mode;
+}
+
+/**
+ * Time from the last STAtion connection attempt to got IP
+ * @return time in ms
+ */
+uint32_t WiFiManagerClass::getTimeToIP() {
+    return timeToIP;
+}
+
+/**
+ * Library tasks stack and handlers statistics (build with -DWFM_PROFILE_ENABLE=1)
+ * @param profile pointer to copy the statistics
+ * @return false if the profiler is disabled
+ */
+bool WiFiManagerClass::getProfile(wfm_profile_t *profile) {
+#if WFM_PROFILE_ENABLE
+    *profile = ::profile;
+    profile->dns_stack_free = 0;
+#if (WFM_AP_DNS_ENABLE)
+    if (dnsServerHandle)
+        profile->dns_stack_free = uxTaskGetStackHighWaterMark(dnsServerHandle);
+#endif
+    return true;
+#else
+    memset(profile, 0, sizeof(wfm_profile_t));
+    return false;
+#endif
+}
+
+/**
+ * Copy the connection events journal (RTC memory, survives the software reset), oldest first.
+ * Sessions are separated by WFM_EVENT_BOOT entries.
+ * @param entries buffer to copy
+ * @param maxEntries buffer size, entries; if the buffer is smaller, the newest entries are copied
+ * @param prevSession copy only the previous session (before the last boot)
+ * @return number of copied entries
+ */
+uint16_t WiFiManagerClass::getJournal(wfm_journal_entry_t *entries, uint16_t maxEntries, bool prevSession) {
+    // copy directly under the lock, the ring is small
+    portENTER_CRITICAL(&journalMux);
+    uint16_t first = (journal.head + WFM_JOURNAL_SIZE - journal.count) % WFM_JOURNAL_SIZE;
+    uint16_t count = journal.count;
+
+    if (prevSession) {
+        // find the last two boots
+        uint16_t boots = 0;
+        uint16_t end = count;
+        for (uint16_t i = count; i > 0; --i) {
+            if (journal.entries[(first + i - 1) % WFM_JOURNAL_SIZE].event == WFM_EVENT_BOOT) {
+                if (++boots == 1) {
+                    end = i - 1;
+                } else {
+                    first = (first + i - 1) % WFM_JOURNAL_SIZE;
+                    count = end - (i - 1);
+                    break;
+                }
+            }
+        }
+        if (boots == 0)
+            count = 0;
+        else if (boots == 1)
+            count = end;  // the session start is overwritten
+    }
+
+    if (count > maxEntries) {
+        // keep the newest entries, they are closer to the trouble
+        first = (first + count - maxEntries) % WFM_JOURNAL_SIZE;
+        count = maxEntries;
+    }
+
+    for (uint16_t i = 0; i < count; ++i)
+        entries[i] = journal.entries[(first + i) % WFM_JOURNAL_SIZE];
+    portEXIT_CRITICAL(&journalMux);
+
+    return count;
+}
+
+/**
+ * Add the user event to the connection events journal (e.g. before the application restart)
+ * @param data user value
+ */
+void WiFiManagerClass::addJournalEvent(uint16_t data) {
+    journal_add(WFM_EVENT_USER, data);
+}
+
+/**
+ * Clean stored WiFi settings (ssid, password, gateway(router) IP, DHCP lease)
  */
 void WiFiManagerClass::cleanWiFiAuthData() {
     memset(ST_ssid, 0, sizeof(ST_ssid));
     memset(ST_pswd, 0, sizeof(ST_pswd));
     memset(ST_gw, 0, sizeof(ST_gw));
+    memset(&ST_lease, 0, sizeof(ST_lease));
     saveWiFiAuthData();
 };
 
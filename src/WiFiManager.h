@@ -13,6 +13,9 @@
 #ifndef WiFiManager_h
 #define WiFiManager_h
 
+#include <stddef.h>
+#include <stdint.h>
+
 #if !defined(WFM_ST_MDNS_ENABLE)
 #define WFM_ST_MDNS_ENABLE 0  // station mDNS service http://%HOSTNAME%.local"
 #endif
@@ -21,10 +24,109 @@
 #define WFM_AP_DNS_ENABLE 1  // access point DNS service
 #endif
 
+#if !defined(WFM_PORTAL_MAX_SOCKETS)
+#define WFM_PORTAL_MAX_SOCKETS 4  // configuration portal keep-alive sockets (page, favicon, OS probes)
+#endif
+
+#if !defined(WFM_MAX_PARAMS)
+#define WFM_MAX_PARAMS 4  // max number of user parameters on the configuration portal
+#endif
+
+#if !defined(WFM_JOURNAL_SIZE)
+#define WFM_JOURNAL_SIZE 64  // connection events journal entries in RTC memory (9 bytes each)
+#endif
+
+#if !defined(WFM_PROFILE_ENABLE)
+#define WFM_PROFILE_ENABLE 0  // tasks stack, handlers heap and time statistics
+#endif
+
 extern "C" {
   typedef void (*callback_fn_t)(void);
 }
 
+typedef enum {
+    WFM_STATE_IDLE = 0,       // not started or STAtion settings are empty
+    WFM_STATE_CONNECTING,     // first connection to the saved STAtion
+    WFM_STATE_CONNECTED,      // STAtion got IP
+    WFM_STATE_ONLINE,         // STAtion got IP and gateway ping OK
+    WFM_STATE_PORTAL_ACTIVE,  // configuration portal is running, STAtion is not connected
+    WFM_STATE_RECOVERING,     // connection lost, reconnecting
+} wfm_state_t;
+
+typedef enum {
+    WFM_READY_ON_PING = 0,      // first successful gateway ping round
+    WFM_READY_ON_GOT_IP,        // STAtion got IP
+    WFM_READY_ON_GOT_IP_PROBE,  // STAtion got IP and immediate one-shot gateway ping OK
+} wfm_ready_policy_t;
+
+typedef enum {
+    WFM_LEASE_OFF = 0,  // full DHCP exchange
+    WFM_LEASE_REBOOT,   // request the last address directly (DHCP INIT-REBOOT), needs CONFIG_LWIP_DHCP_RESTORE_LAST_IP
+    WFM_LEASE_APPLY,    // apply the cached address at once, then confirm it by DHCP, fallback to DHCP on NAK or ping timeout
+} wfm_lease_mode_t;
+
+typedef enum {
+    WFM_IP_DHCP = 0,         // IP from DHCP, static IP is not set or not checked yet
+    WFM_IP_STATIC,           // static IP is applied
+    WFM_IP_STATIC_NEXT,      // static IP is used by another host, the next free address is applied
+    WFM_IP_CONFLICT,         // static IP is used by another host, fallback to DHCP
+    WFM_IP_SUBNET_MISMATCH,  // gateway is not in the static IP subnet, fallback to DHCP
+    WFM_IP_STATIC_UNCHECKED, // STA was not connected in time for the check, static IP is applied unchecked
+} wfm_ip_status_t;
+
+typedef enum {
+    WFM_IP_FALLBACK_DHCP = 0,   // use DHCP if static IP is used by another host
+    WFM_IP_FALLBACK_NEXT_FREE,  // try the next addresses of the subnet, then DHCP
+} wfm_ip_fallback_t;
+
+typedef struct {
+    int8_t core;       // -1 - no affinity, 0 - PRO_CPU, 1 - APP_CPU
+    uint8_t priority;  // FreeRTOS priority
+} wfm_task_cfg_t;
+
+typedef struct {
+    wfm_task_cfg_t dns;    // AP DNS server, default {-1, 1}
+    wfm_task_cfg_t ping;   // ping and got IP probe, default {-1, 1}, core is not supported by esp_ping
+    wfm_task_cfg_t httpd;  // configuration portal, default {-1, 5}
+} wfm_tasks_cfg_t;
+
+typedef enum {
+    WFM_EVENT_BOOT = 0,          // data: esp_reset_reason()
+    WFM_EVENT_STA_CONNECTED,     // data: channel
+    WFM_EVENT_STA_GOT_IP,        // data: time to IP, ms
+    WFM_EVENT_STA_DISCONNECTED,  // data: disconnect reason (wifi_err_reason_t)
+    WFM_EVENT_PING_TIMEOUT,      // recovery: restart WiFi, data: reconnect delay, 100 ms units
+    WFM_EVENT_PORTAL_START,      // configuration Access Point started
+    WFM_EVENT_CFG_RESTART,       // new WiFi settings saved, restart
+    WFM_EVENT_LEASE_REJECTED,    // cached DHCP lease is not valid, return to DHCP
+    WFM_EVENT_USER,              // data: user value
+    WFM_EVENT_IP_CHECK,          // static IP check, data: wfm_ip_status_t
+} wfm_event_t;  // stored in RTC memory, add new events at the end
+
+typedef struct {
+    uint32_t time_ms;  // millis() of the event
+    uint8_t event;     // wfm_event_t
+    int8_t rssi;       // last known RSSI, dBm
+    uint16_t data;     // event data
+} wfm_journal_entry_t;
+
+typedef struct {
+    uint32_t calls;
+    uint32_t time_max_us;     // max execution time
+    uint32_t time_total_us;   // total execution time
+    int32_t heap_delta_min;   // lowest net free heap change over a call (heap kept after return), bytes
+    uint32_t stack_free_min;  // stack high water mark of the calling task, bytes
+} wfm_handler_stat_t;
+
+typedef struct {
+    uint32_t dns_stack_free;     // DNS server task stack high water mark, bytes (0 - not running)
+    wfm_handler_stat_t index;    // portal page (httpd task)
+    wfm_handler_stat_t cfg;      // portal POST (httpd task)
+    wfm_handler_stat_t ping_ok;  // ping success (ping task)
+    wfm_handler_stat_t ping_err; // ping timeout (ping task), without the reconnect delay
+    wfm_handler_stat_t probe;    // got IP one-shot ping success (probe task)
+} wfm_profile_t;
+
 class WiFiManagerClass {
    private:
    public:
@@ -32,18 +134,35 @@ class WiFiManagerClass {
     ~WiFiManagerClass(){};
     bool start(const char *hostname = nullptr);
     bool isConnected();
+    wfm_state_t getState();
+    bool waitForState(wfm_state_t state, uint32_t timeoutMs);
+    uint32_t getStateGeneration();
     void attachOnFirstConnect(callback_fn_t callback_fn);
+    void setReadyPolicy(wfm_ready_policy_t policy);
+    void setReconnectBackoff(uint32_t baseMs, uint32_t capMs, uint32_t resetMs = 300000);
+    uint32_t getReadyTime();
     void attachOnPingOK(callback_fn_t callback_fn);
     void attachOnPingERR(callback_fn_t callback_fn);
     void cleanWiFiAuthData();
+    void setLeaseCache(wfm_lease_mode_t mode);
+    uint32_t getTimeToIP();
+    bool getProfile(wfm_profile_t *profile);
+    uint16_t getJournal(wfm_journal_entry_t *entries, uint16_t maxEntries, bool prevSession = false);
+    void addJournalEvent(uint16_t data);
     void setStaticIP(const char *ip = "192.168.0.200",
                      const char *subnet = "255.255.255.0",
                      const char *gateway = nullptr,
                      const char *dns1 = nullptr,
                      const char *dns2 = nullptr);
+    void setIPConflictCheck(bool enable, wfm_ip_fallback_t fallback = WFM_IP_FALLBACK_DHCP);
+    wfm_ip_status_t getIPStatus();
     void configAP(const char *ssidAP = nullptr,
                const char *passwordAP = nullptr,
-               bool hidden = false);
+               bool hidden = false,
+               uint8_t maxClients = 1);
+    void setTasksConfig(const wfm_tasks_cfg_t *cfg);
+    bool addParameter(const char *id, const char *label, char *value, size_t size);
+    bool addParameter(const char *id, const char *label, int32_t *value, int32_t min, int32_t max);
     static char *url_encode(const char *str);
     static char *url_decode(const char *str);
 };
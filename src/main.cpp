@@ -11,6 +11,8 @@
 
 WebServer server(80);
 
+char device_name[32] = "ESP32 Demo";  // user parameter of the configuration portal
+
 const char demo_page_html[] = R"rawliteral(<html>
 <head>
 <meta http-equiv='refresh' content='2'/>
@@ -44,12 +46,14 @@ void OnPingERR() {
     ping_err_cnt++;
     if (ping_err_cnt > 50) {
         Serial.println("Too many ping errors - restart");
+        WiFiManager.addJournalEvent(ping_err_cnt);
         Serial.flush();
         ESP.restart();
     }
 }
 
 void OnFirstConnect() {
+    Serial.printf("Device name: %s\n", device_name);
     server.on("/", handleRoot);
     server.onNotFound([]() {
         server.send(404, "text/plain", "File Not Found");
@@ -68,6 +72,7 @@ void setup() {
 
     WiFiManager.setStaticIP();
     WiFiManager.configAP("my_ap_ssid", "123456789");
+    WiFiManager.addParameter("dev_name", "Device name", device_name, sizeof(device_name));
     WiFiManager.attachOnFirstConnect(OnFirstConnect);
     WiFiManager.start("esp_hostname");
 }
@@ -84,6 +89,14 @@ void loop() {
                 WiFiManager.cleanWiFiAuthData();
                 Serial.println("cleanWiFiAuthData");
                 break;
+            case 'j': {
+                wfm_journal_entry_t entries[WFM_JOURNAL_SIZE];
+                uint16_t cnt = WiFiManager.getJournal(entries, WFM_JOURNAL_SIZE, true);
+                Serial.printf("previous session: %u events\n", cnt);
+                for (uint16_t i = 0; i < cnt; ++i)
+                    Serial.printf("%10lu ms event=%u data=%u rssi=%d\n", entries[i].time_ms, entries[i].event, entries[i].data, entries[i].rssi);
+                break;
+            }
             case 'i':
                 Serial.printf("CPU freq=%lu MHz\n", ESP.getCpuFreqMHz());
                 break;